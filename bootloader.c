@@ -158,13 +158,126 @@ const uint8_t BOOT_SECTOR[0x3e] __attribute__((aligned(2))) = {
 // Change here to change UF2 data files
 const uint8_t INFO_UF2[70] __attribute__((aligned(2))) = "UF2 Bootloader v0.0.0\nModel: CH32V Generic\nBoard-ID: CH32Vxxx-Generic\n";
 const uint8_t INDEX_HTM[119] __attribute__((aligned(2))) = "<!doctype html>\n<html><body><script>location.replace(\"https://github.com/ArcaneNibble/wch-uf2\")</script></body></html>\n";
-// Change here for different chips
-#define THIS_CHIP_FLASH_MAX_SZ_BYTES    (224 * 1024)
-#define THIS_CHIP_RAM_MAX_SZ_BYTES      (20 * 1024)
-
 #define BOOTLOADER_RESERVED_SZ_BYTES    (4 * 1024)
 #define FAMILY_ID                       0x699b62ec
 
+// Optional features, which can be turned on with e.g.
+// make FEATURES=-DCONFIG_WRITE_BACK_CACHE=1
+// Not all of them fit into 4 KiB at the same time.
+
+// Look up flash and SRAM sizes at runtime from the chip ID and flash capacity
+// in the electronic signature (see chip_mem_kib), instead of assuming
+// 224 KiB of flash and 20 KiB of SRAM.
+#ifndef CONFIG_CHIP_DETECT
+#define CONFIG_CHIP_DETECT              0
+#endif
+
+// Write SRAM downloads straight from the EP1 OUT packets to their destination,
+// instead of collecting them in USB_SECTOR_STASH and copying them after the last packet.
+#ifndef CONFIG_DIRECT_SRAM
+#define CONFIG_DIRECT_SRAM              0
+#endif
+
+// Start erasing a flash page as soon as the UF2 header packet has arrived,
+// so that the erase overlaps with receiving the rest of the block.
+// This only happens for blocks of a file which UF2_GOT_BLOCKS is tracking,
+// which rules out files with more than MAX_AUTO_BOOT_BLOCKS blocks (about 140 KiB of data).
+// Those are erased after the last packet as usual.
+// (There is no spare USBD RAM for remembering the current file some other way.)
+#ifndef CONFIG_ERASE_AHEAD
+#define CONFIG_ERASE_AHEAD              0
+#endif
+
+// Answer INQUIRY for the Supported VPD Pages and Block Limits VPD pages,
+// which advertise transfer lengths matching the flash erase geometry.
+// xxx Linux usb-storage never asks for these (it sets skip_vpd_pages)
+#ifndef CONFIG_VPD_PAGES
+#define CONFIG_VPD_PAGES                0
+#endif
+
+// Handle the Bulk-Only Mass Storage Reset and Get Max LUN class requests
+// (which are otherwise STALLed, which hosts cope with)
+#ifndef CONFIG_BOT_RESET
+#define CONFIG_BOT_RESET                0
+#endif
+
+// Acknowledge written sectors as soon as flash programming has been started,
+// rather than waiting for it to complete. The flash page buffer (together with
+// USB_SECTOR_STASH) acts as a one-page write-back cache.
+// This is flushed on SYNCHRONIZE CACHE, and before rebooting.
+#ifndef CONFIG_WRITE_BACK_CACHE
+#define CONFIG_WRITE_BACK_CACHE         0
+#endif
+
+// Once the final CSW has been sent, jump straight into the application
+// (after detaching from USB and undoing clock and peripheral setup)
+// instead of waiting 50 ms and then going through a full system reset.
+// xxx see the note about soft resets and PLLs when a debugger is attached
+#ifndef CONFIG_FAST_HANDOFF
+#define CONFIG_FAST_HANDOFF             0
+#endif
+
+// Export a table of flash and UF2 entry routines which applications can call
+// (at a fixed address, see startup.S and the README)
+#ifndef CONFIG_SERVICE_TABLE
+#define CONFIG_SERVICE_TABLE            0
+#endif
+
+// Allow the application to stage UF2 blocks (which it received by some other means)
+// in SRAM or flash, and then have the bootloader program them without USB.
+// The address of the first block goes into R16_BKP_DATAR9:R16_BKP_DATAR8,
+// then write BOOT_MAGIC_STAGED_UPDATE into R16_BKP_DATAR10 and reset.
+// Blocks 0 .. numBlocks-1 are processed in order, stopping early at the first
+// one with bad magics or an unexpected blockNo.
+#ifndef CONFIG_STAGED_UPDATE
+#define CONFIG_STAGED_UPDATE            0
+#endif
+
+// When UF2 block 0 arrives (and isn't already in flash), erase the entire range
+// covered by the image (using the largest erase sizes which fit), so that all
+// following blocks only need to be programmed.
+// Needs CONFIG_SKIP_UNCHANGED, which is what keeps those pages (now blank)
+// from being erased a second time.
+// xxx This assumes that images are contiguous and that the host writes the file in order
+// (blocks that arrive *before* block 0 would get erased again).
+#ifndef CONFIG_RANGE_PRE_ERASE
+#define CONFIG_RANGE_PRE_ERASE          0
+#endif
+
+// Applications can start with a header asking for part of themselves to be
+// copied into SRAM and run from there (see startup.S and the README)
+#ifndef CONFIG_RAM_EXEC
+#define CONFIG_RAM_EXEC                 0
+#endif
+
+// Compare incoming UF2 blocks against flash first. Pages which already contain
+// exactly this data are skipped (so that re-copying a .uf2 after an interrupted
+// download only has to program what is actually missing), and blank pages
+// aren't erased.
+#ifndef CONFIG_SKIP_UNCHANGED
+#define CONFIG_SKIP_UNCHANGED           0
+#endif
+#if CONFIG_RANGE_PRE_ERASE && !CONFIG_SKIP_UNCHANGED
+#error "CONFIG_RANGE_PRE_ERASE requires CONFIG_SKIP_UNCHANGED"
+#endif
+
+// Also accept UF2 blocks with FAMILY_ID_SPI_FLASH, and write them into an
+// external SPI NOR flash (mapped at 0x90000000 in the UF2 address space).
+// The flash is connected to SPI1: PA4 = CS#, PA5 = SCK, PA6 = MISO, PA7 = MOSI.
+// Each 4 KiB sector is erased once when the first block for it arrives,
+// and page programs run in the background while the next block is received.
+// xxx This assumes that the host writes each sector's blocks together
+// (going back to an earlier sector erases it again).
+// These blocks don't count towards auto-reboot, so put them *before* the
+// application's blocks when combining both into one .uf2 file.
+#ifndef CONFIG_SPI_FLASH
+#define CONFIG_SPI_FLASH                0
+#endif
+#ifndef SPI_FLASH_SZ_BYTES
+#define SPI_FLASH_SZ_BYTES              (16 * 1024 * 1024)
+#endif
+#define FAMILY_ID_SPI_FLASH             0x4d1c2b7e
+
 // FAT16 root directory entries
 // Most of these parameters *cannot* be changed,
 // as synthesize_block assumes a particular layout
@@ -197,9 +310,59 @@ const uint8_t ROOT_DIR[32 * 3] __attribute__((aligned(2))) = {
     sizeof(INDEX_HTM), sizeof(INDEX_HTM) >> 8, sizeof(INDEX_HTM) >> 16, sizeof(INDEX_HTM) >> 24,
 };
 
+#define ESIG_FLACAP         (*(volatile uint16_t*)0x1FFFF7E0)
+#define ESIG_CHIPID         (*(volatile uint32_t*)0x1FFFF704)
 #define ESIG_UNIID(x)       (*(volatile uint8_t*)(0x1FFFF7E8 + (x)))
 // XXX manual claims 96 bits but only 64 bits seem to actually be programmed?
 
+#if CONFIG_CHIP_DETECT
+// Chip IDs (ESIG_CHIPID[31:16]) which we know the memory layout of,
+// taken from the list in DBGMCU_GetCHIPID() in WCH's CH32V20x SDK
+#define CHIP_IDS_NUM_D8     5
+const uint16_t CHIP_IDS[15] = {
+    // CH32V20x_D8/D8W
+    0x2034,                                             // CH32V203RB
+    0x2080, 0x2081, 0x2082, 0x2083,                     // CH32V208WB/RB/CB/GB
+    // CH32V20x_D6
+    0x2030, 0x2031, 0x2032, 0x2033, 0x2035,             // CH32V203C8U6/C8T6/K8T6/C6T6/K6T6
+    0x2036, 0x2037, 0x2039, 0x203a, 0x203b,             // CH32V203G6U6/F6P6/F6P6/F8P6/G8R6
+};
+#endif
+
+// Returns (total flash in KiB << 16) | (SRAM in KiB)
+// ESIG_FLACAP only counts the "zero-wait" part of flash.
+// * CH32V20x_D8/D8W have 480 KiB of user flash in total (flash memory
+//   organization table in the CH32FV2x_V3x reference manual), and split 192 KiB
+//   between zero-wait flash and SRAM (as configured in the option bytes).
+// * CH32V20x_D6 only document their zero-wait size (32/64 KiB), but the flash
+//   behind it can be programmed up to 224 KiB (which is what this bootloader has
+//   always assumed). SRAM scales with the zero-wait size (10/20 KiB).
+// * Anything else only gets the flash that ESIG_FLACAP reports,
+//   and the smallest SRAM of the family.
+// main() only calls this once, and keeps the result around.
+static uint32_t chip_mem_kib() {
+#if CONFIG_CHIP_DETECT
+    uint32_t id = ESIG_CHIPID >> 16;
+    uint32_t flacap = ESIG_FLACAP;
+    for (uint32_t i = 0; i < sizeof(CHIP_IDS) / 2; i++) {
+        if (CHIP_IDS[i] == id) {
+            if (i < CHIP_IDS_NUM_D8)
+                return (480 << 16) | (192 - flacap);
+            return (224 << 16) | (flacap * 5 / 16);
+        }
+    }
+    return (flacap << 16) | 10;
+#else
+    return (224 << 16) | 20;
+#endif
+}
+__attribute__((always_inline)) static inline uint32_t flash_max_sz_bytes(uint32_t mem_kib) {
+    return (mem_kib >> 16) * 1024;
+}
+__attribute__((always_inline)) static inline uint32_t ram_max_sz_bytes(uint32_t mem_kib) {
+    return (mem_kib & 0xffff) * 1024;
+}
+
 // Note that all of this stuff is declared *extern*
 // A significant amount of code size is being saved because the gp register
 // is pointed at 0x40006000, right at the beginning of USBD RAM
@@ -227,12 +390,19 @@ extern uint32_t CTRL_XFER_STATE;
 extern uint32_t CTRL_XFER_STATE_X;
 extern uint32_t CTRL_XFER_DESC_SZ;
 extern uint32_t USB_SECTOR_STASH[128];
+// Index of the SPI NOR sector which has been erased most recently
+extern uint32_t SPI_NOR_ERASED;
 
 // Files larger than this won't cause an auto-reboot
 // (there is not enough USBD RAM to mark which blocks have been received)
 // The last bit (MSB) of the last halfword is used to mark
 // "has received the first valid UF2 block which contains a valid block count"
+// (one halfword is given up for SPI_NOR_ERASED when that is needed)
+#if !CONFIG_SPI_FLASH
 #define AUTO_BOOT_BITMAP_NUM_HWORDS     36
+#else
+#define AUTO_BOOT_BITMAP_NUM_HWORDS     35
+#endif
 #define MAX_AUTO_BOOT_BLOCKS            (AUTO_BOOT_BITMAP_NUM_HWORDS * 16 - 1)
 extern uint32_t UF2_GOT_BLOCKS[AUTO_BOOT_BITMAP_NUM_HWORDS];
 
@@ -245,8 +415,15 @@ extern uint32_t UF2_GOT_BLOCKS[AUTO_BOOT_BITMAP_NUM_HWORDS];
 #define USB_STAT_NAK        0b10
 #define USB_STAT_ACK        0b11
 
+#define USB_DTOG_RX         (1 << 14)
+#define USB_DTOG_TX         (1 << 6)
+
 // Other registers we need
+#define R16_BKP_DATAR8      (*(volatile uint32_t*)0x40006C20)
+#define R16_BKP_DATAR9      (*(volatile uint32_t*)0x40006C24)
 #define R16_BKP_DATAR10     (*(volatile uint32_t*)0x40006C28)
+#define BOOT_MAGIC_APP_IMMEDIATELY      0x4170
+#define BOOT_MAGIC_STAGED_UPDATE        0x5374
 
 #define R32_PWR_CTLR        (*(volatile uint32_t*)0x40007000)
 
@@ -275,6 +452,10 @@ extern volatile uint16_t R16_USBD_DADDR;
 
 #define R32_EXTEN_CTR       (*(volatile uint32_t*)0x40023800)
 
+#define R32_SPI1_CTLR1      (*(volatile uint32_t*)0x40013000)
+#define R32_SPI1_STATR      (*(volatile uint32_t*)0x40013008)
+#define R32_SPI1_DATAR      (*(volatile uint32_t*)0x4001300C)
+
 #define STK_CTLR            (*(volatile uint32_t*)0xE000F000)
 #define STK_SR              (*(volatile uint32_t*)0xE000F004)
 #define STK_CMPLR           (*(volatile uint32_t*)0xE000F010)
@@ -300,9 +481,16 @@ extern volatile uint16_t R16_USBD_DADDR;
 #define STATE_WANT_CBW          0x00
 #define STATE_SENT_CSW          0x01
 #define STATE_SENT_CSW_REBOOT   0x02
+//  state[11] = endpoints were stalled because of an error,
+//              CSW has to be sent once the host clears the halt
+#define STATE_CSW_AFTER_STALL   0x800
 #define STATE_SENT_DATA_IN      0x03
 //  state[10:8] = sector fragment
 #define STATE_SEND_MORE_READ    0x04
+//  state[16] = uf2 is going to SPI NOR flash (CONFIG_SPI_FLASH)
+//  state[15] = flash has been unlocked (page erase has been started)
+//  state[14] = uf2 is going to flash
+//  state[13] = uf2 is going to SRAM
 //  state[12] = uf2 good so far
 //  state[10:8] = sector fragment
 #define STATE_WAITING_FOR_WRITE 0x05
@@ -321,7 +509,7 @@ extern volatile uint16_t R16_USBD_DADDR;
 // This is not entirely stable and relies on hand-checking
 // the generated assembly.
 
-__attribute__((always_inline)) static inline void set_ep_mode(uint32_t epidx, uint32_t epaddr, uint32_t eptype, uint32_t stat_rx, uint32_t stat_tx, uint32_t xtra, int clear_dtog) {
+__attribute__((always_inline)) static inline void set_ep_mode(uint32_t epidx, uint32_t epaddr, uint32_t eptype, uint32_t stat_rx, uint32_t stat_tx, uint32_t xtra, uint32_t clear_dtog) {
     // The way the shifts are written has been tweaked
     // to generate smaller code than some possible alternatives.
     // "xtra" is used solely to set bit8 (EP_KIND, STATUS_OUT).
@@ -332,12 +520,9 @@ __attribute__((always_inline)) static inline void set_ep_mode(uint32_t epidx, ui
     // 3. ZLP OUT (H->D) for status signaling
     // The bit optimizes step 3 s.t. it is not necessary to
     // check that a ZLP specifically was received.
+    // "clear_dtog" selects which data toggles get reset back to DATA0.
     uint32_t val = R16_USBD_EPR[epidx];
-    uint32_t cur_stats;
-    if (clear_dtog)
-        cur_stats = val & 0x7070;
-    else
-        cur_stats = val & 0x3030;
+    uint32_t cur_stats = val & (0x3030 | clear_dtog);
     uint32_t want_stats = (stat_rx << 12) | (stat_tx) << 4;
     R16_USBD_EPR[epidx] = epaddr | (eptype << 9) | xtra | (cur_stats ^ want_stats);
 }
@@ -361,12 +546,68 @@ __attribute__((always_inline)) static inline uint32_t min(uint32_t a, uint32_t b
     return b;
 }
 
+// Copying into and out of USBD RAM
+// These are inlined because they are used from other (outlined) functions.
+// Packed halfwords -> USBD RAM
+__attribute__((always_inline)) static inline void unpack_to_usbd(volatile uint32_t *dst, const uint16_t *src, uint32_t hwords) {
+    for (uint32_t i = 0; i < hwords; i++)
+        dst[i] = src[i];
+}
+// USBD RAM -> packed halfwords (hwords must be even)
+__attribute__((always_inline)) static inline void pack_from_usbd(volatile uint32_t *dst, const volatile uint32_t *src, uint32_t hwords) {
+    for (uint32_t i = 0; i < hwords / 2; i++)
+        dst[i] = src[i * 2] | (src[i * 2 + 1] << 16);
+}
+// USBD RAM -> USBD RAM
+__attribute__((always_inline)) static inline void copy_usbd(volatile uint32_t *dst, const volatile uint32_t *src, uint32_t hwords) {
+    for (uint32_t i = 0; i < hwords; i++)
+        dst[i] = src[i];
+}
+
 const uint8_t MODE_SENSE_6[4] __attribute__((aligned(2))) = {
     0x03, 0x00, 0x00, 0x00,
 };
 const uint8_t MODE_SENSE_10[8] __attribute__((aligned(2))) = {
-    0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+#if CONFIG_WRITE_BACK_CACHE
+// Same as above, with the caching mode page appended
+#define MODE_PAGE_CACHING \
+    0x08,                                       /* page code */ \
+    0x12,                                       /* page length */ \
+    0x04,                                       /* WCE */ \
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+const uint8_t MODE_SENSE_6_CACHING[24] __attribute__((aligned(2))) = {
+    0x17, 0x00, 0x00, 0x00,
+    MODE_PAGE_CACHING,
+};
+const uint8_t MODE_SENSE_10_CACHING[28] __attribute__((aligned(2))) = {
+    0x00, 0x1a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    MODE_PAGE_CACHING,
+};
+#endif
+#if CONFIG_VPD_PAGES
+// SCSI INQUIRY VPD pages
+const uint8_t VPD_SUPPORTED_PAGES[6] __attribute__((aligned(2))) = {
+    0x00,   // direct access block device
+    0x00,   // page code
+    0x00, 0x02,     // page length
+    0x00,   // supported VPD pages
+    0xb0,   // block limits
 };
+// This is the (shorter) SBC-2 version of this page, matching the SPC-2 claim in INQUIRY_RESPONSE
+// One UF2 block is 256 bytes of flash per 512-byte sector,
+// so 128 sectors correspond to a 32 KiB flash erase block.
+const uint8_t VPD_BLOCK_LIMITS[16] __attribute__((aligned(2))) = {
+    0x00,   // direct access block device
+    0xb0,   // page code
+    0x00, 0x0c,     // page length
+    0x00, 0x00,     // reserved
+    0x00, 0x01,     // optimal transfer length granularity
+    0x00, 0x00, 0x00, 0x80,     // maximum transfer length
+    0x00, 0x00, 0x00, 0x80,     // optimal transfer length
+};
+#endif
 const uint8_t READ_FORMAT_CAPACITY[12] __attribute__((aligned(2))) = {
     0x00, 0x00, 0x00,
     0x08,
@@ -379,8 +620,7 @@ const uint8_t READ_CAPACITY[8] __attribute__((aligned(2))) = {
     0x00, 0x00, 0x02, 0x00,
 };
 static void ep1_send_hardcoded_response(const uint16_t *data, uint32_t len) {
-    for (uint32_t i = 0; i < (len + 1) / 2; i++)
-        USB_EP1_IN[i] = data[i];
+    unpack_to_usbd(USB_EP1_IN, data, (len + 1) / 2);
     USB_DESCS[1].count_tx = len;
     set_ep1_ack_in();
 }
@@ -405,9 +645,11 @@ static void synthesize_block(uint32_t block, uint32_t piece) {
 
         uint32_t cur_offset_16bits = piece * 32;
 
-        int usbofs, secofs;
-        for (usbofs = 0, secofs = cur_offset_16bits; usbofs < 32 && secofs < sector_sz_16bits; usbofs++, secofs++)
-            USB_EP1_IN[usbofs] = sector_ptr[secofs];
+        uint32_t usbofs = 0;
+        if (cur_offset_16bits < sector_sz_16bits) {
+            usbofs = min(32, sector_sz_16bits - cur_offset_16bits);
+            unpack_to_usbd(USB_EP1_IN, sector_ptr + cur_offset_16bits, usbofs);
+        }
         for (; usbofs < 32; usbofs++)
             USB_EP1_IN[usbofs] = 0;
 
@@ -431,6 +673,122 @@ static void synthesize_block(uint32_t block, uint32_t piece) {
     set_ep1_ack_in();
 }
 
+// Note that flash *doesn't* erase to 0xffffffff (see startup.S)
+#define FLASH_ERASED_WORD   0xe339e339
+
+__attribute__((always_inline)) static inline void flash_unlock() {
+    R32_FLASH_KEYR = 0x45670123;
+    R32_FLASH_KEYR = 0xCDEF89AB;
+    R32_FLASH_MODEKEYR = 0x45670123;
+    R32_FLASH_MODEKEYR = 0xCDEF89AB;
+}
+// Waits for any flash operation which is still running in the background,
+// then locks flash again
+__attribute__((always_inline)) static inline void flash_flush() {
+    while (R32_FLASH_STATR & 1) {}
+    R32_FLASH_CTLR = (1 << 15) | (1 << 7);
+}
+// Doesn't wait for the erase to finish
+static void flash_erase_page_start(uint32_t address) {
+#if CONFIG_WRITE_BACK_CACHE
+    flash_flush();
+#endif
+    flash_unlock();
+    R32_FLASH_CTLR = 1 << 17;
+    R32_FLASH_ADDR = address;
+    R32_FLASH_CTLR = (1 << 17) | (1 << 6);
+}
+
+#if CONFIG_SERVICE_TABLE || CONFIG_STAGED_UPDATE
+// Programs a page from a normal (not USBD) buffer and waits for it to finish
+static void flash_program_page(uint32_t address, const uint32_t *data) {
+#if CONFIG_WRITE_BACK_CACHE
+    flash_flush();
+#endif
+    flash_unlock();
+    R32_FLASH_CTLR = 1 << 16;
+    for (int i = 0; i < 64; i++) {
+        ((volatile uint32_t *)address)[i] = data[i];
+        while (R32_FLASH_STATR & 2) {}
+    }
+    R32_FLASH_CTLR = (1 << 16) | (1 << 21);
+    flash_flush();
+}
+#endif
+
+#if CONFIG_SERVICE_TABLE
+// These are called *by the application*, which has a stack but also its own gp.
+// This means that, unlike everything else, these *must not* touch USBD RAM
+// (or anything else that gets accessed gp-relative).
+// Same bounds check as for UF2 blocks. The 0x0000xxxx alias of flash is accepted too.
+// Returns the 0x08xxxxxx address, or 0 if it isn't allowed.
+static uint32_t svc_check_address(uint32_t address) {
+    if ((address >> 24) == 0)
+        address += 0x08000000;
+    if ((address & 0xff) == 0 &&
+        address >= 0x08000000 + BOOTLOADER_RESERVED_SZ_BYTES &&
+        address <= 0x08000000 + flash_max_sz_bytes(chip_mem_kib()) - 256)
+        return address;
+    return 0;
+}
+int svc_page_erase(uint32_t address) {
+    address = svc_check_address(address);
+    if (!address)
+        return -1;
+    flash_erase_page_start(address);
+    flash_flush();
+    return 0;
+}
+int svc_page_program(uint32_t address, const uint32_t *data) {
+    address = svc_check_address(address);
+    if (!address)
+        return -1;
+    flash_program_page(address, data);
+    return 0;
+}
+// Standard (zlib/PNG) CRC-32, bitwise to save space
+uint32_t svc_crc32(const uint8_t *data, uint32_t len) {
+    uint32_t crc = 0xffffffff;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+#endif
+
+#if CONFIG_SPI_FLASH
+#define SPI_NOR_CS_LOW()    R32_GPIOA_BSHR = 1 << (16 + 4)
+#define SPI_NOR_CS_HIGH()   R32_GPIOA_BSHR = 1 << 4
+
+__attribute__((always_inline)) static inline uint32_t spi_xfer(uint32_t val) {
+    R32_SPI1_DATAR = val & 0xff;
+    while (!(R32_SPI1_STATR & 1)) {}
+    return R32_SPI1_DATAR;
+}
+// Waits for the previous program/erase to finish
+__attribute__((always_inline)) static inline void spi_nor_wait() {
+    SPI_NOR_CS_LOW();
+    spi_xfer(0x05);
+    while (spi_xfer(0) & 1) {}
+    SPI_NOR_CS_HIGH();
+}
+// Waits, sends WRITE ENABLE, and then starts a command with a 24-bit address.
+// CS# is left asserted.
+static void spi_nor_begin(uint32_t cmd, uint32_t address) {
+    spi_nor_wait();
+    SPI_NOR_CS_LOW();
+    spi_xfer(0x06);
+    SPI_NOR_CS_HIGH();
+    SPI_NOR_CS_LOW();
+    spi_xfer(cmd);
+    spi_xfer(address >> 16);
+    spi_xfer(address >> 8);
+    spi_xfer(address);
+}
+#endif
+
 static void make_msc_csw(uint32_t dCSWTag, uint32_t error) {
     USB_EP1_IN[0] = 0x5355;
     USB_EP1_IN[1] = 0x5342;
@@ -442,12 +800,56 @@ static void make_msc_csw(uint32_t dCSWTag, uint32_t error) {
     USB_DESCS[1].count_tx = 13;
     set_ep1_ack_in();
 }
+// Sends at most alloc_len bytes (the CDB's ALLOCATION LENGTH) of a hardcoded response.
+// If that is 0, there is no data phase at all, and the CSW is sent right away.
+// Returns the new msc_state.
+__attribute__((always_inline)) static inline uint32_t ep1_send_clipped_response(const uint16_t *data, uint32_t len, uint32_t alloc_len, uint32_t dCSWTag) {
+    if (alloc_len == 0) {
+        make_msc_csw(dCSWTag, 0);
+        return STATE_SENT_CSW;
+    }
+    ep1_send_hardcoded_response(data, min(len, alloc_len));
+    return STATE_SENT_DATA_IN;
+}
 
 __attribute__((naked)) int main(void) {
     // Make sure this stuff is enabled
     // (not every startup.S code path activates them)
     R32_RCC_APB1PCENR |= (1 << 27) | (1 << 28);
     R32_PWR_CTLR |= 1 << 8;
+    uint32_t mem_kib = chip_mem_kib();
+#if CONFIG_STAGED_UPDATE
+    if (R16_BKP_DATAR10 == BOOT_MAGIC_STAGED_UPDATE) {
+        // Still running off of HSI here, which is fine for programming flash
+        R16_BKP_DATAR10 = 0;
+        uint32_t blk_addr = R16_BKP_DATAR8 | (R16_BKP_DATAR9 << 16);
+        // The walk is bounded by the first block's numBlocks,
+        // and blockNo has to count up from 0 without gaps
+        uint32_t num_blocks = ((const uint32_t *)blk_addr)[6];
+        for (uint32_t blocknum = 0; blocknum < num_blocks; blocknum++) {
+            const uint32_t *blk = (const uint32_t *)blk_addr;
+            if (blk[0] != 0x0A324655 || blk[1] != 0x9E5D5157 || blk[127] != 0x0AB16F30 ||
+                blk[5] != blocknum || blk[6] != num_blocks)
+                break;
+            uint32_t address = blk[3];
+            // Only flash is allowed as a destination
+            // (so that the staging area can't get overwritten in SRAM)
+            // Destinations overlapping staging in flash is the application's problem.
+            if ((blk[2] & 0x2001) == 0x2000 && blk[7] == FAMILY_ID && blk[4] == 256 &&
+                (address & 0xff) == 0 &&
+                address >= 0x08000000 + BOOTLOADER_RESERVED_SZ_BYTES &&
+                address <= 0x08000000 + flash_max_sz_bytes(mem_kib) - 256) {
+                flash_erase_page_start(address);
+                flash_flush();
+                flash_program_page(address, blk + 8);
+            }
+            blk_addr += 512;
+        }
+        R16_BKP_DATAR10 = BOOT_MAGIC_APP_IMMEDIATELY;
+        PFIC_CFGR = 0xbeef0080;
+        while (1) { asm volatile(""); }
+    }
+#endif
     R16_BKP_DATAR10 = 0;
 
     // PLL setup: system clock 96 MHz
@@ -463,6 +865,15 @@ __attribute__((naked)) int main(void) {
     R32_GPIOA_CFGHR = (R32_GPIOA_CFGHR & ~(0xff << 12)) | (0b00100010 << 12);
     R32_GPIOA_BSHR = (1 << 27) | (1 << 28);
 
+#if CONFIG_SPI_FLASH
+    // SPI1 master, mode 0, 24 MHz
+    R32_RCC_APB2PCENR |= (1 << 12);
+    SPI_NOR_CS_HIGH();
+    R32_GPIOA_CFGLR = (R32_GPIOA_CFGLR & ~(0xffff << 16)) | (0xb4b3 << 16);
+    R32_SPI1_CTLR1 = 0x34c;
+    SPI_NOR_ERASED = 0xffff;
+#endif
+
     // Enable USB
     R32_RCC_APB1PCENR |= (1 << 23);
     R16_USBD_CNTR = 1;
@@ -535,22 +946,60 @@ __attribute__((naked)) int main(void) {
                         set_ep0_ack_in();
                     } else if (bRequest_bmRequestType == 0x0102) {
                         // CLEAR_FEATURE
-                        // XXX how is this supposed to work?
                         // Not implementing this will cause subtle breakage
                         // when an unsupported SCSI command is sent.
+                        // Clearing a halt always resets the data toggle.
+                        // If the halt was because of a failed command, the host
+                        // then expects to read the (failed) CSW.
                         uint32_t wIndex = USB_EP0_OUT[2];
                         if (wIndex == 0x81) {
-                            uint32_t dCSWTag = CSWTAG_LO | (CSWTAG_HI << 16);
-                            make_msc_csw(dCSWTag, 1);
-                            msc_state = (msc_state & 0xffffff00) | STATE_SENT_CSW;
+                            uint32_t ep1 = R16_USBD_EPR[1];
+                            set_ep_mode(1, 1, USB_EPTYPE_BULK, (ep1 >> 12) & 3, USB_STAT_NAK, 0, USB_DTOG_TX);
+                            if (msc_state & STATE_CSW_AFTER_STALL) {
+                                uint32_t dCSWTag = CSWTAG_LO | (CSWTAG_HI << 16);
+                                make_msc_csw(dCSWTag, 1);
+                                msc_state = (msc_state & 0xfffff000) | STATE_SENT_CSW;
+                            }
+                            USB_DESCS[0].count_tx = 0;
                             set_ep0_ack_in();
                         } else if (wIndex == 0x01) {
-                            set_ep1_ack_out();
+                            set_ep_mode(1, 1, USB_EPTYPE_BULK, USB_STAT_ACK, USB_STAT_STALL, 0, USB_DTOG_RX);
                             msc_state = (msc_state & 0xffffff00) | STATE_WANT_CBW;
+                            USB_DESCS[0].count_tx = 0;
+                            set_ep0_ack_in();
+                        } else {
+                            set_ep0_stall();
+                        }
+#if CONFIG_BOT_RESET
+                    } else if (bRequest_bmRequestType == 0xFF21) {
+                        // Bulk-Only Mass Storage Reset
+                        // Abandon whatever command was in progress, and go back
+                        // to waiting for a CBW. The data toggles and any STALLs
+                        // are left alone, as the host clears those itself afterwards
+                        // with CLEAR_FEATURE.
+                        if (USB_EP0_OUT[1] == 0 && USB_EP0_OUT[2] == 0 && wLength == 0) {
+                            flash_flush();
+                            uint32_t ep1 = R16_USBD_EPR[1];
+                            uint32_t stat_rx = (ep1 >> 12) & 3;
+                            uint32_t stat_tx = (ep1 >> 4) & 3;
+                            if (stat_rx != USB_STAT_STALL)
+                                stat_rx = USB_STAT_ACK;
+                            if (stat_tx != USB_STAT_STALL)
+                                stat_tx = USB_STAT_NAK;
+                            set_ep_mode(1, 1, USB_EPTYPE_BULK, stat_rx, stat_tx, 0, 0);
+                            msc_state = STATE_WANT_CBW;
+                            USB_DESCS[0].count_tx = 0;
                             set_ep0_ack_in();
                         } else {
                             set_ep0_stall();
                         }
+                    } else if (bRequest_bmRequestType == 0xFEA1) {
+                        // Get Max LUN
+                        USB_EP0_IN[0] = 0;
+                        USB_DESCS[0].count_tx = min(1, wLength);
+                        CTRL_XFER_STATE = STATE_CTRL_SIMPLE_IN;
+                        set_ep0_ack_in();
+#endif
                     } else if (bRequest_bmRequestType == 0x0500) {
                         // SET_ADDRESS
                         CTRL_XFER_STATE_X = USB_EP0_OUT[1];
@@ -567,7 +1016,8 @@ __attribute__((naked)) int main(void) {
                             } else if (wValue == 0x0200) {
                                 outputting_desc = USB_CONF_DESC;
                                 CTRL_XFER_DESC_SZ = sizeof(USB_CONF_DESC);
-                            } else if (wValue == 0x0301) {
+                            }
+                            else if (wValue == 0x0301) {
                                 outputting_desc = (uint8_t*)USB_MANUF;
                                 CTRL_XFER_DESC_SZ = sizeof(USB_MANUF);
                             } else if (wValue == 0x0302) {
@@ -628,7 +1078,7 @@ __attribute__((naked)) int main(void) {
                             ACTIVE_CONFIG = wValue;
                             if (wValue) {
                                 // activate, allow OUT
-                                set_ep_mode(1, 1, USB_EPTYPE_BULK, USB_STAT_ACK, USB_STAT_STALL, 0, 1);
+                                set_ep_mode(1, 1, USB_EPTYPE_BULK, USB_STAT_ACK, USB_STAT_STALL, 0, USB_DTOG_RX | USB_DTOG_TX);
                                 msc_state = STATE_WANT_CBW;
                             } else {
                                 // deactivate
@@ -677,7 +1127,8 @@ __attribute__((naked)) int main(void) {
                                         bytes = CTRL_XFER_DESC_SZ - byte_pos;
                                     for (int i = 0; i < bytes; i+=2)
                                         USB_EP0_IN[i / 2] = *((uint16_t*)(outputting_desc + byte_pos + i));
-                                } else {
+                                }
+                                else {
                                     uint32_t serial_no_pos = (byte_pos - 2) / 2;
                                     uint32_t ascii_bytes = (bytes + 1) / 2;
                                     if (serial_no_pos + ascii_bytes > 24) {
@@ -716,6 +1167,12 @@ __attribute__((naked)) int main(void) {
                             uint32_t dCSWTag = CSWTAG_LO | (CSWTAG_HI << 16);
                             uint32_t dCBWDataTransferLength = USB_EP1_OUT[4] | (USB_EP1_OUT[5] << 16);
                             uint32_t operation_code = USB_EP1_OUT[7] >> 8;
+#if CONFIG_WRITE_BACK_CACHE
+                            uint32_t page_code;
+#endif
+#if CONFIG_VPD_PAGES || CONFIG_WRITE_BACK_CACHE
+                            uint32_t alloc_len;
+#endif
 
                             switch (operation_code) {
                                 case 0x00:
@@ -740,16 +1197,39 @@ __attribute__((naked)) int main(void) {
                                     break;
                                 case 0x12:
                                     // inquiry
+                                    // @ 16: page code, EVPD
                                     if (USB_EP1_OUT[8] == 0) {
                                         ep1_send_hardcoded_response((uint16_t*)INQUIRY_RESPONSE, sizeof(INQUIRY_RESPONSE));
                                         msc_state = STATE_SENT_DATA_IN;
                                         break;
                                     }
-                                    msc_state = STATE_SENT_CSW | (5 << 20) | (0x24 << 24);
+#if CONFIG_VPD_PAGES
+                                    // @ 18: allocation length (big-endian)
+                                    alloc_len = ((USB_EP1_OUT[9] & 0xff) << 8) | (USB_EP1_OUT[9] >> 8);
+                                    if (USB_EP1_OUT[8] == 0x0001) {
+                                        msc_state = ep1_send_clipped_response((uint16_t*)VPD_SUPPORTED_PAGES, sizeof(VPD_SUPPORTED_PAGES), alloc_len, dCSWTag);
+                                        break;
+                                    }
+                                    if (USB_EP1_OUT[8] == 0xb001) {
+                                        msc_state = ep1_send_clipped_response((uint16_t*)VPD_BLOCK_LIMITS, sizeof(VPD_BLOCK_LIMITS), alloc_len, dCSWTag);
+                                        break;
+                                    }
+#endif
+                                    msc_state = STATE_SENT_CSW | STATE_CSW_AFTER_STALL | (5 << 20) | (0x24 << 24);
                                     set_ep_mode(1, 1, USB_EPTYPE_BULK, USB_STAT_STALL, USB_STAT_STALL, 0, 0);
                                     break;
                                 case 0x1a:
                                     // mode sense (6)
+                                    // @ 16: page code, flags
+#if CONFIG_WRITE_BACK_CACHE
+                                    page_code = (USB_EP1_OUT[8] >> 8) & 0x3f;
+                                    if (page_code == 0x08 || page_code == 0x3f) {
+                                        // @ 18: allocation length
+                                        alloc_len = USB_EP1_OUT[9] >> 8;
+                                        msc_state = ep1_send_clipped_response((uint16_t*)MODE_SENSE_6_CACHING, sizeof(MODE_SENSE_6_CACHING), alloc_len, dCSWTag);
+                                        break;
+                                    }
+#endif
                                     ep1_send_hardcoded_response((uint16_t*)MODE_SENSE_6, sizeof(MODE_SENSE_6));
                                     msc_state = STATE_SENT_DATA_IN;
                                     break;
@@ -774,9 +1254,26 @@ __attribute__((naked)) int main(void) {
                                     break;
                                 case 0x5a:
                                     // mode sense (10)
+#if CONFIG_WRITE_BACK_CACHE
+                                    page_code = (USB_EP1_OUT[8] >> 8) & 0x3f;
+                                    if (page_code == 0x08 || page_code == 0x3f) {
+                                        // @ 22: allocation length (big-endian)
+                                        alloc_len = ((USB_EP1_OUT[11] & 0xff) << 8) | (USB_EP1_OUT[11] >> 8);
+                                        msc_state = ep1_send_clipped_response((uint16_t*)MODE_SENSE_10_CACHING, sizeof(MODE_SENSE_10_CACHING), alloc_len, dCSWTag);
+                                        break;
+                                    }
+#endif
                                     ep1_send_hardcoded_response((uint16_t*)MODE_SENSE_10, sizeof(MODE_SENSE_10));
                                     msc_state = STATE_SENT_DATA_IN;
                                     break;
+#if CONFIG_WRITE_BACK_CACHE
+                                case 0x35:
+                                    // synchronize cache (10)
+                                    flash_flush();
+                                    make_msc_csw(dCSWTag, 0);
+                                    msc_state = STATE_SENT_CSW;
+                                    break;
+#endif
                                 case 0x25:
                                     // READ CAPACITY (10)
                                     // xxx don't bother checking the silly fields
@@ -804,7 +1301,7 @@ __attribute__((naked)) int main(void) {
                                         // The following two checks are out of paranoia
                                         // Hosts don't seem to send this crap
                                         if (blocks > 0x4000 || lba >= 0x4000 || (blocks + lba) > 0x4000) {
-                                            msc_state = STATE_SENT_CSW | (5 << 20) | (0x24 << 24);
+                                            msc_state = STATE_SENT_CSW | STATE_CSW_AFTER_STALL | (5 << 20) | (0x24 << 24);
                                             set_ep_mode(1, 1, USB_EPTYPE_BULK, USB_STAT_STALL, USB_STAT_STALL, 0, 0);
                                             break;
                                         }
@@ -851,6 +1348,7 @@ __attribute__((naked)) int main(void) {
                                     if (dCBWDataTransferLength == 0) {
                                         make_msc_csw(dCSWTag, 1);
                                     } else {
+                                        msc_state |= STATE_CSW_AFTER_STALL;
                                         set_ep_mode(1, 1, USB_EPTYPE_BULK, USB_STAT_STALL, USB_STAT_STALL, 0, 0);
                                     }
                                     break;
@@ -875,28 +1373,86 @@ __attribute__((naked)) int main(void) {
                                 uint32_t blocknum_hi = USB_EP1_OUT[11];
                                 uint32_t totblocks_hi = USB_EP1_OUT[13];
 
+                                uint32_t spi = CONFIG_SPI_FLASH && familyid == FAMILY_ID_SPI_FLASH;
+
                                 if (bytes_lo == 256 && bytes_hi == 0 && (address_lo & 0xff) == 0 && blocknum_hi == 0 && totblocks_hi == 0) {
-                                    if (flags_lo & (0x2000) && familyid == FAMILY_ID) {
+                                    if (flags_lo & (0x2000) && (familyid == FAMILY_ID || spi)) {
                                         // uf2 good so far!
 
                                         // *preliminary* bounds check
-                                        if ((!(flags_lo & 1) && (address_hi >> 8) == 0x08) || ((flags_lo & 1) && (address_hi >> 8) == 0x20)) {
+                                        if ((!(flags_lo & 1) && (address_hi >> 8) == (spi ? 0x90 : 0x08)) || (!spi && (flags_lo & 1) && (address_hi >> 8) == 0x20)) {
+                                            uint32_t address = address_lo | (address_hi << 16);
                                             ADDRESS_LO = address_lo;
                                             ADDRESS_HI = address_hi;
                                             BLOCKNUM_LO = USB_EP1_OUT[10];
-                                            TOTBLOCKS_LO = USB_EP1_OUT[12];
 
-                                            for (int i = 0; i < 16; i++)
-                                                USB_SECTOR_STASH[i] = USB_EP1_OUT[16 + i];
+                                            if (address >= 0x20000000 && address <= 0x20000000 + ram_max_sz_bytes(mem_kib) - 256) {
+#if CONFIG_DIRECT_SRAM
+                                                // SRAM downloads don't go through USB_SECTOR_STASH at all.
+                                                // Data is written to its final destination as soon as it arrives,
+                                                // *before* the final magic has been checked. This is fine because
+                                                // the final magic only "commits" the block to UF2_GOT_BLOCKS
+                                                // (and nothing runs from SRAM until every block is committed).
+                                                pack_from_usbd((volatile uint32_t *)address, USB_EP1_OUT + 16, 16);
+#else
+                                                copy_usbd(USB_SECTOR_STASH, USB_EP1_OUT + 16, 16);
+#endif
+                                                msc_state += 0x2000;
+                                            } else {
+#if CONFIG_SPI_FLASH
+                                                if (spi) {
+                                                    if (address <= 0x90000000 + SPI_FLASH_SZ_BYTES - 256)
+                                                        msc_state += 0x10000;
+                                                } else
+#endif
+                                                if (address >= 0x08000000 + BOOTLOADER_RESERVED_SZ_BYTES &&
+                                                    address <= 0x08000000 + flash_max_sz_bytes(mem_kib) - 256) {
+#if CONFIG_ERASE_AHEAD
+                                                    // Start erasing right now. The erase runs in the background
+                                                    // while the remaining 7 packets are received, and piece 7
+                                                    // only has to wait for whatever is left of it.
+                                                    // This is only done once UF2_GOT_BLOCKS is tracking the file
+                                                    // this block belongs to (its first block has been seen, and
+                                                    // the block count matches). Anything else waits for piece 7,
+                                                    // where the final magic has been checked, so that a stray or
+                                                    // interrupted sector can't wipe an arbitrary page.
+                                                    if ((UF2_GOT_BLOCKS[AUTO_BOOT_BITMAP_NUM_HWORDS - 1] & 0x8000) && USB_EP1_OUT[12] == TOTBLOCKS_LO) {
+#if CONFIG_SKIP_UNCHANGED
+                                                        // ... unless the start of the page says that it's
+                                                        // either already the same or blank
+                                                        uint32_t dirty = 0;
+                                                        for (int i = 0; i < 8; i++) {
+                                                            uint32_t cur = ((volatile uint32_t *)address)[i];
+                                                            uint32_t val = USB_EP1_OUT[16 + i * 2] | (USB_EP1_OUT[16 + i * 2 + 1] << 16);
+                                                            if (cur != val && cur != FLASH_ERASED_WORD)
+                                                                dirty = 1;
+                                                        }
+                                                        if (dirty)
+#endif
+                                                        {
+                                                            flash_erase_page_start(address);
+                                                            msc_state += 0x8000;
+                                                        }
+                                                    }
+#endif
+                                                    msc_state += 0x4000;
+                                                }
+                                                copy_usbd(USB_SECTOR_STASH, USB_EP1_OUT + 16, 16);
+                                            }
 
+                                            TOTBLOCKS_LO = USB_EP1_OUT[12];
                                             msc_state += 0x1000;
                                         }
                                     }
                                 }
                             }
                         } else if (piece >= 1 && piece <= 4) {
-                            for (int i = 0; i < (piece != 4 ? 32 : 16); i++)
-                                USB_SECTOR_STASH[16 + (piece - 1) * 32 + i] = USB_EP1_OUT[i];
+                            if (CONFIG_DIRECT_SRAM && (msc_state & 0x2000)) {
+                                volatile uint32_t *dst = (volatile uint32_t *)((ADDRESS_LO | (ADDRESS_HI << 16)) + 32 + (piece - 1) * 64);
+                                pack_from_usbd(dst, USB_EP1_OUT, piece != 4 ? 32 : 16);
+                            } else {
+                                copy_usbd(USB_SECTOR_STASH + 16 + (piece - 1) * 32, USB_EP1_OUT, piece != 4 ? 32 : 16);
+                            }
                         }
 
                         if (piece != 7) {
@@ -911,7 +1467,9 @@ __attribute__((naked)) int main(void) {
                                     uint32_t blocknum = BLOCKNUM_LO;
                                     uint32_t totblocks = TOTBLOCKS_LO;
 
-                                    if (UF2_GOT_BLOCKS[AUTO_BOOT_BITMAP_NUM_HWORDS - 1] & 0x8000) {
+                                    if (CONFIG_SPI_FLASH && (msc_state & 0x10000)) {
+                                        // SPI NOR blocks aren't tracked for auto-reboot
+                                    } else if (UF2_GOT_BLOCKS[AUTO_BOOT_BITMAP_NUM_HWORDS - 1] & 0x8000) {
                                         // not first uf2 block
                                         UF2_GOT_BLOCKS[blocknum / 16] |= 1 << (blocknum % 16);
                                     } else {
@@ -927,16 +1485,74 @@ __attribute__((naked)) int main(void) {
                                         }
                                     }
 
-                                    if (address >= 0x08000000 + BOOTLOADER_RESERVED_SZ_BYTES &&
-                                        address <= 0x08000000 + THIS_CHIP_FLASH_MAX_SZ_BYTES - 256) {
-                                        R32_FLASH_KEYR = 0x45670123;
-                                        R32_FLASH_KEYR = 0xCDEF89AB;
-                                        R32_FLASH_MODEKEYR = 0x45670123;
-                                        R32_FLASH_MODEKEYR = 0xCDEF89AB;
-                                        R32_FLASH_CTLR = 1 << 17;
-                                        R32_FLASH_ADDR = address;
-                                        R32_FLASH_CTLR = (1 << 17) | (1 << 6);
+                                    uint32_t same = 0;
+                                    if ((msc_state & 0xc000) == 0x4000) {
+                                        // No erase in progress yet
+#if CONFIG_SKIP_UNCHANGED
+                                        // so now check the entire page
+                                        same = 1;
+                                        uint32_t blank = 1;
+                                        for (int i = 0; i < 64; i++) {
+                                            uint32_t cur = ((volatile uint32_t *)address)[i];
+                                            uint32_t val = USB_SECTOR_STASH[i * 2] | (USB_SECTOR_STASH[i * 2 + 1] << 16);
+                                            if (cur != val)
+                                                same = 0;
+                                            if (cur != FLASH_ERASED_WORD)
+                                                blank = 0;
+                                        }
+                                        if (!same && !blank)
+#endif
+                                        {
+                                            flash_erase_page_start(address);
+                                            msc_state += 0x8000;
+                                        }
+                                    }
+#if CONFIG_RANGE_PRE_ERASE
+                                    if (blocknum == 0 && (msc_state & 0x4000) && !same) {
+                                        uint32_t end = address + totblocks * 256;
+                                        if (end > 0x08000000 + flash_max_sz_bytes(mem_kib))
+                                            end = 0x08000000 + flash_max_sz_bytes(mem_kib);
+                                        if (!(msc_state & 0x8000)) {
+#if CONFIG_WRITE_BACK_CACHE
+                                            flash_flush();
+#endif
+                                            flash_unlock();
+                                            msc_state += 0x8000;
+                                        }
+                                        for (uint32_t a = address; a < end;) {
+                                            uint32_t mode, step;
+                                            if (!(a & 0x7fff) && a + 0x8000 <= end) {
+                                                // 32 KiB block (fast mode)
+                                                mode = 1 << 18;
+                                                step = 0x8000;
+                                            } else if (!(a & 0xfff) && a + 0x1000 <= end) {
+                                                // 4 KiB sector (standard mode)
+                                                mode = 1 << 1;
+                                                step = 0x1000;
+                                            } else {
+                                                mode = 1 << 17;
+                                                step = 0x100;
+                                            }
+                                            while (R32_FLASH_STATR & 1) {}
+                                            R32_FLASH_CTLR = mode;
+                                            R32_FLASH_ADDR = a;
+                                            R32_FLASH_CTLR = mode | (1 << 6);
+                                            a += step;
+                                        }
+                                    }
+#endif
+                                    if ((msc_state & 0x4000) && !same) {
+                                        // Wait for the erase (if any) which may have been started
+                                        // back when the header arrived
                                         while (R32_FLASH_STATR & 1) {}
+                                        if (!(msc_state & 0x8000)) {
+                                            // blank page, not unlocked yet
+#if CONFIG_WRITE_BACK_CACHE
+                                            flash_flush();
+#endif
+                                            flash_unlock();
+                                            msc_state += 0x8000;
+                                        }
                                         R32_FLASH_CTLR = 1 << 16;
                                         // Yes, we can program flash while running from it!
                                         // (as long as we are in the "zero-wait" area which we are)
@@ -947,18 +1563,54 @@ __attribute__((naked)) int main(void) {
                                             while (R32_FLASH_STATR & 2) {}
                                         }
                                         R32_FLASH_CTLR = (1 << 16) | (1 << 21);
-                                        while (R32_FLASH_STATR & 1) {}
-                                        R32_FLASH_CTLR = (1 << 15) | (1 << 7);
                                     }
-                                    if (address >= 0x20000000 && address <= 0x20000000 + THIS_CHIP_RAM_MAX_SZ_BYTES - 256) {
+#if CONFIG_DIRECT_SRAM
+                                    // (SRAM blocks were already written directly while being received)
+#else
+                                    if (msc_state & 0x2000) {
                                         for (int i = 0; i < 64; i++) {
                                             volatile uint32_t *addr = (volatile uint32_t *)(address + i * 4);
                                             uint32_t val = USB_SECTOR_STASH[i * 2] | (USB_SECTOR_STASH[i * 2 + 1] << 16);
                                             *addr = val;
                                         }
                                     }
+#endif
+#if CONFIG_SPI_FLASH
+                                    if (msc_state & 0x10000) {
+                                        // Entering a new sector, so erase it first.
+                                        // This waits until the final magic has been checked,
+                                        // so that a stray sector can't wipe anything.
+                                        // Block 0 starts a new file, which is allowed to
+                                        // rewrite the sector the previous one ended in.
+                                        if (blocknum == 0)
+                                            SPI_NOR_ERASED = 0xffff;
+                                        uint32_t sector = (address >> 12) & 0xffff;
+                                        if (sector != SPI_NOR_ERASED) {
+                                            spi_nor_begin(0x20, address);
+                                            SPI_NOR_CS_HIGH();
+                                            SPI_NOR_ERASED = sector;
+                                        }
+                                        // Not waiting for this to finish, that happens
+                                        // before the next command is sent.
+                                        spi_nor_begin(0x02, address);
+                                        for (int i = 0; i < 128; i++) {
+                                            uint32_t val = USB_SECTOR_STASH[i];
+                                            spi_xfer(val);
+                                            spi_xfer(val >> 8);
+                                        }
+                                        SPI_NOR_CS_HIGH();
+                                    }
+#endif
                                 }
                             }
+#if !CONFIG_WRITE_BACK_CACHE
+                            if (msc_state & 0x8000) {
+                                // This also has to happen if the final magic turned out to be bad.
+                                // The erase can't be undone, but at least don't leave flash
+                                // busy and unlocked.
+                                flash_flush();
+                            }
+#endif
 
                             if (SCSI_XFER_BLK_LEFT == 1) {
                                 uint32_t dCSWTag = CSWTAG_LO | (CSWTAG_HI << 16);
@@ -987,6 +1639,8 @@ __attribute__((naked)) int main(void) {
                         msc_state = (msc_state & 0xffffff00) | STATE_WANT_CBW;
                         break;
                     case STATE_SENT_CSW_REBOOT:
+                        flash_flush();
+#if !CONFIG_FAST_HANDOFF
                         // Microsoft's bootloader claims we need to do this
                         // (but we didn't personally test it)
                         STK_CMPLR = (50 /* ms */ * 12000 /* assume 96 MHz system clock, div8 */);
@@ -995,8 +1649,47 @@ __attribute__((naked)) int main(void) {
                         while (!(STK_SR & 1)) {}
                         STK_CTLR = 0;
                         STK_SR = 0;
+#else
+                        // ADDRESS_HI lives in USBD RAM, which can't be read
+                        // once USBD (and its clock) has been shut down
+                        uint32_t ram_boot = ADDRESS_HI >> 8 == 0x20;
+#endif
                         R16_USBD_CNTR = 0b11;
                         R32_EXTEN_CTR &= ~(1 << 1);
+#if CONFIG_FAST_HANDOFF
+                        // Put everything main() touched back to reset values
+                        // clock back to HSI, then PLL off
+                        R32_RCC_CFGR0 = 0;
+                        while ((R32_RCC_CFGR0 & 0b1100) != 0b0000) {}
+                        R32_RCC_CTLR &= ~(1 << 24);
+                        R32_EXTEN_CTR &= ~(1 << 4);
+                        // USB pins back to floating inputs
+                        R32_GPIOA_CFGHR = (R32_GPIOA_CFGHR & ~(0xff << 12)) | (0b01000100 << 12);
+#if CONFIG_SPI_FLASH
+                        // Wait for the last page program, then release SPI1 and its pins
+                        spi_nor_wait();
+                        R32_SPI1_CTLR1 = 0;
+                        R32_GPIOA_CFGLR = (R32_GPIOA_CFGLR & ~(0xffff << 16)) | (0x4444 << 16);
+                        R32_RCC_APB2PCENR &= ~(1 << 12);
+#endif
+                        R32_RCC_APB2PCENR &= ~(1 << 2);
+                        // (R16_BKP_DATAR10 was already cleared at the very beginning)
+                        R32_PWR_CTLR &= ~(1 << 8);
+                        R32_RCC_APB1PCENR &= ~((1 << 23) | (1 << 27) | (1 << 28));
+                        if (ram_boot)
+                            asm volatile("la t0, 0x20000000\njr t0\n1:\nj 1b\n");
+                        // Same check as startup.S, don't jump into blank flash
+                        // (the reset ends up back in the bootloader)
+                        if (*(volatile uint32_t *)(0x08000000 + BOOTLOADER_RESERVED_SZ_BYTES) == FLASH_ERASED_WORD) {
+                            PFIC_CFGR = 0xbeef0080;
+                            while (1) { asm volatile(""); }
+                        }
+#if CONFIG_RAM_EXEC
+                        asm volatile("la t0, _jump_to_application\njr t0\n1:\nj 1b\n");
+#else
+                        asm volatile("la t0, _bootloader_limit\njr t0\n1:\nj 1b\n");
+#endif
+#else
                         if (ADDRESS_HI >> 8 == 0x20) {
                             // ram boot, go back to original clock settings
                             R32_RCC_CFGR0 = (R32_RCC_CFGR0 & ~0b11) | 0b00;
@@ -1008,10 +1701,11 @@ __attribute__((naked)) int main(void) {
                             // xxx weird things seem to happen if you try to soft reset
                             // (or mess with PLLs) when the debugger is attached
                             // we didn't fully characterize this
-                            R16_BKP_DATAR10 = 0x4170;
+                            R16_BKP_DATAR10 = BOOT_MAGIC_APP_IMMEDIATELY;
                             PFIC_CFGR = 0xbeef0080;
                             while (1) { asm volatile(""); }
                         }
+#endif
                         break;
                     case STATE_SENT_DATA_IN:
                         make_msc_csw(dCSWTag, 0);